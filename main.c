@@ -14,12 +14,36 @@
 #include "SCAN.C"
 #include "CODE.H"
 #include "CODE.C"
+#include "PEEP.H"
+#include "PEEP.C"
+#include "TMOBJ.H"
+#include "TMOBJ.C"
 #include "SYMTAB.H"
 #include "SYMTAB.C"
 #include "UTIL.H"
 #include "UTIL.C"
+#include "FLATTREE.H"
+#include "FLATTREE.C"
+#include "OPTIM.H"
+#include "OPTIM.C"
+#include "IR.H"
+#include "IR.C"
+#include "LOOP.H"
+#include "LOOP.C"
+#include "SSA.H"
+#include "SSA.C"
+#include "INLINE.H"
+#include "INLINE.C"
+#include "ISEL.H"
+#include "ISEL.C"
 #include "CGEN.H"
 #include "CGEN.C"
+#include "X86GEN.H"
+#include "X86GEN.C"
+#include "STATS.H"
+#include "STATS.C"
+#include "BATCH.H"
+#include "BATCH.C"
 /* set NO_PARSE to TRUE to get a scanner-only compiler */
 #define NO_PARSE FALSE
 /* set NO_ANALYZE to TRUE to get a parser-only compiler */
@@ -41,6 +65,7 @@
 #if !NO_ANALYZE
 
 #include "analyze.h"
+#include "optim.h"
 
 #if !NO_CODE
 
@@ -50,73 +75,240 @@
 #endif
 #endif
 
-/* allocate global variables */
-int lineno = 0;
-FILE *source;
-FILE *listing;
-FILE *code;
-
 /* allocate and set tracing flags */
 int EchoSource = FALSE;
 int TraceScan = FALSE;
 int TraceParse = TRUE;
 int TraceAnalyze = FALSE;
+AnalysisMode AnalyzeMode = FusedAnalysis;
+int FlatLayout = FALSE;
 int TraceCode = FALSE;
+int TraceIR = FALSE;
+int TraceMemory = FALSE;
+int TraceStats = FALSE;
+int BinaryCode = FALSE;
+int DebugInfo = FALSE;
+int NativeCode = FALSE;
+int OptLevel = 0;
+int BoundsCheck = FALSE;
 
-int Error = FALSE;
-
-int main(int argc, char *argv[]) {
-    TreeNode *syntaxTree;
-    char pgm[120]; /* source code file name */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <filename>\n", argv[0]);
-        exit(1);
+/* Function compileFile compiles the TINY program in
+ * file name (".tny" is added when it has no extension)
+ * with the listing going to listing; it returns TRUE
+ * if the file was compiled without errors
+ */
+static int compileFile(const char *name, FILE *listing) {
+    Compiler comp; /* state of the compilation */
+    FILE *source;
+    TreeNode *syntaxTree = NULL;
+    FlatTree *flatTree = NULL;
+    char *pgm; /* source code file name */
+    pgm = (char *) malloc(strlen(name) + 5);
+    if (pgm == NULL) {
+        fprintf(listing, "Out of memory error\n");
+        return FALSE;
     }
-    strcpy(pgm, argv[1]);
+    strcpy(pgm, name);
     if (strchr(pgm, '.') == NULL)
         strcat(pgm, ".tny");
     source = fopen(pgm, "r");
     if (source == NULL) {
-        fprintf(stderr, "File %s not found\n", pgm);
-        exit(1);
+        fprintf(listing, "File %s not found\n", pgm);
+        free(pgm);
+        return FALSE;
+    }
+    initCompiler(&comp, source, listing);
+    fprintf(comp.listing, "\nTINY COMPILATION: %s\n", pgm);
+    if (TraceStats) {
+        /* time the scanner alone, then start over */
+        comp.countOnly = TRUE;
+        beginPhase(&comp, ScanPhase);
+        while (getToken(&comp) != ENDFILE) comp.tokenCount++;
+        endPhase(&comp, ScanPhase);
+        comp.countOnly = FALSE;
+        rewindSource(&comp);
     }
-    listing = stdout; /* send listing to screen */
-    fprintf(listing, "\nTINY COMPILATION: %s\n", pgm);
 #if NO_PARSE
-    while (getToken()!=ENDFILE);
+    while (getToken(&comp)!=ENDFILE);
 #else
-    syntaxTree = parse();
+    beginPhase(&comp, ParsePhase);
+#if !NO_ANALYZE
+    if (AnalyzeMode == ParseAnalysis) comp.stmtParsed = analyzeStmt;
+#endif
+    if (FlatLayout) flatTree = parseFlat(&comp);
+    else syntaxTree = parse(&comp);
+    endPhase(&comp, ParsePhase);
     if (TraceParse) {
-        fprintf(listing, "\nSyntax tree:\n");
-        printTree(syntaxTree);
+        fprintf(comp.listing, "\nSyntax tree:\n");
+        if (flatTree != NULL) printFlatTree(&comp, flatTree);
+        else printTree(comp.listing, syntaxTree);
     }
 #if !NO_ANALYZE
-    if (!Error) {
-        if (TraceAnalyze) fprintf(listing, "\nBuilding Symbol Table...\n");
-        buildSymtab(syntaxTree);
-        if (TraceAnalyze) fprintf(listing, "\nChecking Types...\n");
-        typeCheck(syntaxTree);
-        if (TraceAnalyze) fprintf(listing, "\nType Checking Finished\n");
+    if (AnalyzeMode == ParseAnalysis) {
+        if (TraceAnalyze) {
+            fprintf(comp.listing, "\nSymbol table:\n\n");
+            printSymTab(&comp, comp.listing);
+        }
+    } else if (!comp.Error && AnalyzeMode == FusedAnalysis) {
+        if (TraceAnalyze) fprintf(comp.listing, "\nAnalyzing...\n");
+        beginPhase(&comp, AnalyzePhase);
+        if (FlatLayout) analyzeFlat(&comp, flatTree);
+        else analyze(&comp, syntaxTree);
+        endPhase(&comp, AnalyzePhase);
+        if (TraceAnalyze) fprintf(comp.listing, "\nType Checking Finished\n");
+    } else if (!comp.Error) {
+        if (TraceAnalyze) fprintf(comp.listing, "\nBuilding Symbol Table...\n");
+        beginPhase(&comp, SymtabPhase);
+        if (FlatLayout) buildSymtabFlat(&comp, flatTree);
+        else buildSymtab(&comp, syntaxTree);
+        endPhase(&comp, SymtabPhase);
+        if (TraceAnalyze) fprintf(comp.listing, "\nChecking Types...\n");
+        beginPhase(&comp, TypePhase);
+        if (FlatLayout) typeCheckFlat(&comp, flatTree);
+        else typeCheck(&comp, syntaxTree);
+        endPhase(&comp, TypePhase);
+        if (TraceAnalyze) fprintf(comp.listing, "\nType Checking Finished\n");
+    }
+    if (!comp.Error && OptLevel > 0) {
+        beginPhase(&comp, OptimizePhase);
+        if (FlatLayout) foldConstantsFlat(&comp, flatTree);
+        else foldConstants(&comp, syntaxTree);
+        endPhase(&comp, OptimizePhase);
+        fprintf(comp.listing, "\nConstant folding removed %d nodes\n", comp.foldCount);
     }
 #if !NO_CODE
-    if (!Error) {
+    if (!comp.Error) {
         char *codefile;
         int fnlen = strcspn(pgm, ".");
         codefile = (char *) calloc(fnlen + 4, sizeof(char));
         strncpy(codefile, pgm, fnlen);
-        strcat(codefile, ".tm");
-        code = fopen(codefile, "w");
-        if (code == NULL) {
-            printf("Unable to open %s\n", codefile);
-            exit(1);
+        strcat(codefile, NativeCode ? ".s" : ".tm");
+        comp.code = fopen(codefile, "w");
+        if (BinaryCode && !NativeCode && comp.code != NULL) {
+            /* the object file is named like the code file */
+            char *objfile = (char *) calloc(fnlen + 5, sizeof(char));
+            if (objfile != NULL) {
+                strncpy(objfile, pgm, fnlen);
+                strcat(objfile, ".tmo");
+                comp.object = fopen(objfile, "wb");
+                if (comp.object == NULL)
+                    fprintf(comp.listing, "Unable to open %s\n", objfile);
+                free(objfile);
+            }
+        }
+        if (comp.code == NULL) {
+            fprintf(comp.listing, "Unable to open %s\n", codefile);
+            comp.Error = TRUE;
+        } else {
+            beginPhase(&comp, CodePhase);
+            if (NativeCode && FlatLayout)
+                codeGenX86Flat(&comp, flatTree, codefile);
+            else if (NativeCode)
+                codeGenX86(&comp, syntaxTree, codefile);
+            else if (FlatLayout)
+                codeGenFlat(&comp, flatTree, codefile);
+            else
+                codeGen(&comp, syntaxTree, codefile);
+            endPhase(&comp, CodePhase);
+            if (OptLevel > 0 && !NativeCode)
+                fprintf(comp.listing, "\nPeephole optimization removed %d instructions\n", comp.peepCount);
+            fclose(comp.code);
+            if (comp.object != NULL) fclose(comp.object);
         }
-        codeGen(syntaxTree, codefile);
-        fclose(code);
+        free(codefile);
     }
 #endif
 #endif
 #endif
+    if (TraceMemory) printArenaStats(&comp);
+    if (TraceStats) {
+        char *statsfile = (char *) malloc(strlen(pgm) + 12);
+        if (statsfile != NULL) {
+            int fnlen = strcspn(pgm, ".");
+            printStats(&comp);
+            strncpy(statsfile, pgm, fnlen);
+            strcpy(statsfile + fnlen, ".stats.json");
+            if (!writeStats(&comp, pgm, statsfile))
+                fprintf(comp.listing, "Unable to write %s\n", statsfile);
+            free(statsfile);
+        }
+    }
+    freeFlatTree(&comp, flatTree);
+    st_clear(&comp);
+    releaseArena(&comp);
+    releaseSource(&comp);
     fclose(source);
-    return 0;
+    free(pgm);
+    return !comp.Error;
+}
+
+/* usage prints the command line syntax and exits */
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [--stats] [-O level] [--bounds] [--ir] [--analyze mode] [--flat] [--binary [-g] | --native] <filename>\n", prog);
+    fprintf(stderr, "       %s [--stats] [-O level] [--bounds] [--ir] [--analyze mode] [--flat] [--binary [-g] | --native] [-j workers] <filename|@manifest> ...\n", prog);
+    fprintf(stderr, "analysis modes: two (symbol table, then types), fused (one traversal, the default), parse (while parsing)\n");
+    fprintf(stderr, "--flat builds the syntax tree in the compact FlatTree layout\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    char **names;
+    int count = 0, workers = 0, i;
+    names = (char **) malloc(argc * sizeof(char *));
+    if (names == NULL) exit(1);
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--stats") == 0) {
+            TraceStats = TRUE;
+        } else if (strcmp(argv[i], "--binary") == 0) {
+            BinaryCode = TRUE;
+        } else if (strcmp(argv[i], "--native") == 0) {
+            NativeCode = TRUE;
+        } else if (strcmp(argv[i], "--ir") == 0) {
+            TraceIR = TRUE;
+        } else if (strcmp(argv[i], "--bounds") == 0) {
+            BoundsCheck = TRUE;
+        } else if (strcmp(argv[i], "--flat") == 0) {
+            FlatLayout = TRUE;
+        } else if (strcmp(argv[i], "-g") == 0) {
+            DebugInfo = TRUE;
+        } else if (strncmp(argv[i], "-O", 2) == 0) {
+            /* -O alone is -O1, else -O0 to -O9 or -O level */
+            const char *level = argv[i] + 2;
+            if (*level == '\0' && i + 1 < argc && isdigit((unsigned char) argv[i + 1][0]))
+                level = argv[++i];
+            OptLevel = (*level == '\0') ? 1 : atoi(level);
+        } else if (strcmp(argv[i], "--analyze") == 0) {
+            const char *mode = ++i < argc ? argv[i] : "";
+            if (strcmp(mode, "two") == 0) AnalyzeMode = TwoPassAnalysis;
+            else if (strcmp(mode, "fused") == 0) AnalyzeMode = FusedAnalysis;
+            else if (strcmp(mode, "parse") == 0) AnalyzeMode = ParseAnalysis;
+            else usage(argv[0]);
+        } else if (strcmp(argv[i], "-j") == 0) {
+            if (++i == argc || (workers = atoi(argv[i])) <= 0) usage(argv[0]);
+        } else if (argv[i][0] == '@') {
+            int n, j;
+            char **listed = readManifest(argv[i] + 1, &n);
+            char **more;
+            if (listed == NULL) {
+                fprintf(stderr, "Manifest %s not found\n", argv[i] + 1);
+                exit(1);
+            }
+            more = (char **) realloc(names, (count + n + argc) * sizeof(char *));
+            if (more == NULL) exit(1);
+            names = more;
+            for (j = 0; j < n; j++) names[count++] = listed[j];
+            free(listed);
+        } else names[count++] = argv[i];
+    }
+    if (count == 0) usage(argv[0]);
+    if (count == 1 && workers == 0) {
+        /* a single file is compiled directly as before */
+        int ok = compileFile(names[0], stdout);
+        free(names);
+        return ok ? 0 : 1;
+    }
+    i = runBatch(names, count, workers, compileFile);
+    free(names);
+    return i == 0 ? 0 : 1;
 }
 